@@ -0,0 +1,868 @@
+// Differential fuzzing of my_snprintf against the C library's snprintf.
+//
+// Every test case is decoded from a stream of bytes: a format with one
+// conversion (flags, width, precision and length modifier included), its
+// arguments, and the output buffer size. The same decoder serves three
+// front ends:
+//
+//   - libFuzzer: build with -DMYPRINTF_LIBFUZZER -fsanitize=fuzzer; the
+//     fuzzer supplies the bytes.
+//   - AFL and corpus replay: fuzz_printf FILE... runs one case per file, so
+//     a build with CC=afl-clang-fast runs as afl-fuzz ... -- ./fuzz_printf @@
+//   - Deterministic check: fuzz_printf [-n N] [-s SEED] feeds the decoder
+//     from a seeded generator, counts mismatches per conversion and then
+//     times every conversion against snprintf.
+//
+// The formatter does not match glibc everywhere yet, so the check works as
+// a ratchet against FILE from --baseline FILE, which records the cases that
+// differed, a digest of my_snprintf's output for each of them and each
+// conversion's time relative to snprintf. The run fails when a case that
+// matched in FILE no longer does, when the output of a case that differed
+// changes, when a conversion gets slower than --threshold times its
+// recorded ratio, or when FILE is missing or was recorded with another
+// seed, iteration count, C library version or support for wide
+// conversions. FILE is only written with --record.
+// Conversions listed with -c must match exactly.
+//
+// The libFuzzer and replay front ends only run my_snprintf by default, so
+// they stop on crashes and sanitizer errors rather than on divergences
+// that are already known. Output is compared with snprintf, and a mismatch
+// aborts, only for the conversions named by MYPRINTF_FUZZ_CONVERSIONS (or
+// -c for replay).
+#define _POSIX_C_SOURCE 199309L
+
+#include <errno.h>
+#include <limits.h>
+#include <locale.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <wchar.h>
+#ifdef __GLIBC__
+#include <gnu/libc-version.h>
+#endif
+
+#define ALL_CONVERSIONS "diouxXcspnfFeEgGaA%"
+#define OUTPUT_SIZE 512
+#define GUARD_SIZE 16
+#define MAX_REPORTS 3
+#define MAX_NEW_REPORTS 10
+#define BENCH_CASES 64
+#define BENCH_REPEATS 15
+#define BENCH_CALLS 20
+#define BENCH_RETRIES 2
+
+int my_snprintf(char *output, size_t max_size, const char *format, ...);
+
+// Source of the bytes a case is decoded from: fuzzer input, or a seeded
+// xorshift generator when data is NULL
+struct byte_source {
+    const uint8_t *data;
+    size_t size;
+    size_t position;
+    uint64_t state;
+};
+
+// Kinds of argument a conversion consumes
+enum argument_kind {
+    ARG_NONE, ARG_INT, ARG_LONG, ARG_LONG_LONG, ARG_INTMAX, ARG_SIZE, ARG_PTRDIFF,
+    ARG_DOUBLE, ARG_LONG_DOUBLE, ARG_STRING, ARG_WIDE_STRING, ARG_WIDE_CHAR,
+    ARG_POINTER, ARG_COUNT
+};
+
+// One decoded test case
+struct test_case {
+    char format[96];
+    char conversion;
+    int stars;
+    int star_values[2];
+    enum argument_kind kind;
+    long long integer;
+    long double real;
+    const char *string;
+    const wchar_t *wide_string;
+    wint_t wide_char;
+    void *pointer;
+    size_t size;
+};
+
+static const char *const strings[] = {
+    "", "a", "hello", "Hello, World!", "caf\xc3\xa9", "\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e",
+    "tab\tand\nnewline", "a fairly long string that is longer than most field widths used here",
+    NULL
+};
+
+static const wchar_t *const wide_strings[] = {
+    L"", L"a", L"hello", L"café", L"日本語", L"emoji \U0001F600 end", NULL
+};
+
+static const char *const literals[] = { "", "", "x", "[", "value: ", "%% " };
+
+static int wide_supported;
+
+static uint8_t next_byte(struct byte_source *source) {
+    if (!source->data) {
+        source->state ^= source->state << 13;
+        source->state ^= source->state >> 7;
+        source->state ^= source->state << 17;
+        return (uint8_t)(source->state >> 24);
+    }
+    return (source->position < source->size) ? source->data[source->position++] : 0;
+}
+
+static uint64_t next_bits(struct byte_source *source, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value = (value << 8) | next_byte(source);
+    }
+    return value;
+}
+
+static size_t pick(struct byte_source *source, size_t count) {
+    return next_byte(source) % count;
+}
+
+// An integer drawn from edge values and random magnitudes
+static long long next_integer(struct byte_source *source) {
+    static const long long edges[] = {
+        0, 1, -1, 7, 10, 42, -42, 255, 256, 65535, INT_MAX, INT_MIN, UINT_MAX,
+        LLONG_MAX, LLONG_MIN
+    };
+    if (next_byte(source) & 1) {
+        return edges[pick(source, sizeof(edges) / sizeof(edges[0]))];
+    }
+    uint64_t bits = next_bits(source, 8);
+    return (long long)(bits >> pick(source, 64));
+}
+
+// A double drawn from special values, short decimals and raw bit patterns
+static double next_double(struct byte_source *source) {
+    static const double edges[] = {
+        0.0, -0.0, 1.0, -1.0, 0.5, 0.1, 3.14159, 1e10, 1e-10, 123456789.0, 1e300, 5e-324
+    };
+    switch (pick(source, 6)) {
+        case 0: return edges[pick(source, sizeof(edges) / sizeof(edges[0]))];
+        case 1: return (next_byte(source) & 1) ? INFINITY : -INFINITY;
+        case 2: return NAN;
+        case 3: return (double)(int32_t)next_bits(source, 4) / (double)(1 + next_bits(source, 2));
+        case 4: return (double)(int16_t)next_bits(source, 2) * pow(10.0, (int)pick(source, 41) - 20);
+        default: {
+            uint64_t bits = next_bits(source, 8);
+            double value;
+            memcpy(&value, &bits, sizeof(value));
+            return value;
+        }
+    }
+}
+
+// A valid Unicode scalar value, biased towards ASCII
+static wint_t next_wide_char(struct byte_source *source) {
+    switch (pick(source, 4)) {
+        case 0: return 0x20 + pick(source, 0x5F);
+        case 1: return 0x80 + (wint_t)next_bits(source, 2) % 0x780;
+        case 2: return 0xE000 + (wint_t)next_bits(source, 2) % 0x2000;
+        default: return 0x10000 + (wint_t)next_bits(source, 3) % 0x100000;
+    }
+}
+
+// Decode one case; a non-zero forced conversion overrides the decoded one
+static void decode_case(struct byte_source *source, struct test_case *test, char forced) {
+    static const char *const integer_modifiers[] = { "", "hh", "h", "l", "ll", "j", "z", "t" };
+    static const enum argument_kind integer_kinds[] = {
+        ARG_INT, ARG_INT, ARG_INT, ARG_LONG, ARG_LONG_LONG, ARG_INTMAX, ARG_SIZE, ARG_PTRDIFF
+    };
+    static const char flag_characters[] = "-+ #0";
+    char *format = test->format;
+    int length = 0;
+
+    memset(test, 0, sizeof(*test));
+    test->conversion = forced ? forced : ALL_CONVERSIONS[pick(source, strlen(ALL_CONVERSIONS))];
+
+    length += sprintf(format + length, "%s%%", literals[pick(source, sizeof(literals) / sizeof(literals[0]))]);
+
+    int flag_count = pick(source, 4);
+    for (int i = 0; i < flag_count; i++) {
+        format[length++] = flag_characters[pick(source, sizeof(flag_characters) - 1)];
+    }
+
+    switch (pick(source, 4)) {
+        case 1: length += sprintf(format + length, "%d", (int)pick(source, 30)); break;
+        case 2: test->star_values[test->stars++] = (int)pick(source, 61) - 30;
+                format[length++] = '*'; break;
+        default: break;
+    }
+    switch (pick(source, 4)) {
+        case 1: length += sprintf(format + length, ".%d", (int)pick(source, 25)); break;
+        case 2: test->star_values[test->stars++] = (int)pick(source, 31) - 5;
+                length += sprintf(format + length, ".*"); break;
+        case 3: format[length++] = '.'; break;
+        default: break;
+    }
+
+    switch (test->conversion) {
+        case 'd': case 'i': case 'o': case 'u': case 'x': case 'X': {
+            size_t modifier = pick(source, sizeof(integer_kinds) / sizeof(integer_kinds[0]));
+            length += sprintf(format + length, "%s", integer_modifiers[modifier]);
+            test->kind = integer_kinds[modifier];
+            test->integer = next_integer(source);
+            break;
+        }
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A': {
+            test->kind = ARG_DOUBLE;
+            if (pick(source, 4) == 0) {
+                format[length++] = 'L';
+                test->kind = ARG_LONG_DOUBLE;
+            }
+            test->real = next_double(source);
+            break;
+        }
+        // Both the wide and the narrow argument are always drawn, so the
+        // stream of cases is the same with or without a UTF-8 locale
+        case 'c': {
+            int wide = next_byte(source) & 1;
+            wint_t wide_char = next_wide_char(source);
+            unsigned char narrow = next_byte(source);
+            if (wide && wide_supported) {
+                format[length++] = 'l';
+                test->kind = ARG_WIDE_CHAR;
+                test->wide_char = wide_char;
+            } else {
+                test->kind = ARG_INT;
+                test->integer = narrow;
+            }
+            break;
+        }
+        case 's': {
+            int wide = next_byte(source) & 1;
+            size_t wide_index = pick(source, sizeof(wide_strings) / sizeof(wide_strings[0]));
+            size_t narrow_index = pick(source, sizeof(strings) / sizeof(strings[0]));
+            if (wide && wide_supported) {
+                format[length++] = 'l';
+                test->kind = ARG_WIDE_STRING;
+                test->wide_string = wide_strings[wide_index];
+            } else {
+                test->kind = ARG_STRING;
+                test->string = strings[narrow_index];
+            }
+            break;
+        }
+        case 'p': {
+            test->kind = ARG_POINTER;
+            test->pointer = (void *)(uintptr_t)next_integer(source);
+            break;
+        }
+        case 'n': {
+            test->kind = ARG_COUNT;
+            break;
+        }
+        default: {
+            test->kind = ARG_NONE;
+            break;
+        }
+    }
+
+    format[length++] = test->conversion;
+    sprintf(format + length, "%s", literals[pick(source, sizeof(literals) / sizeof(literals[0]))]);
+
+    // Mostly roomy buffers, sometimes tight ones to exercise truncation
+    test->size = (pick(source, 4) == 0) ? pick(source, 12) : OUTPUT_SIZE;
+}
+
+// Call a snprintf-like function with the case's star values and argument
+#define FORMAT_CASE(function, output, test, value)                                             \
+    ((test)->stars == 0 ? function(output, (test)->size, (test)->format, value) :             \
+     (test)->stars == 1 ? function(output, (test)->size, (test)->format, (test)->star_values[0], value) : \
+     function(output, (test)->size, (test)->format, (test)->star_values[0], (test)->star_values[1], value))
+
+#define RUN_CASE(function, output, test, count)                                                \
+    do {                                                                                       \
+        switch ((test)->kind) {                                                                \
+            case ARG_NONE:                                                                     \
+            case ARG_INT: result = FORMAT_CASE(function, output, test, (int)(test)->integer); break; \
+            case ARG_LONG: result = FORMAT_CASE(function, output, test, (long)(test)->integer); break; \
+            case ARG_LONG_LONG: result = FORMAT_CASE(function, output, test, (test)->integer); break; \
+            case ARG_INTMAX: result = FORMAT_CASE(function, output, test, (intmax_t)(test)->integer); break; \
+            case ARG_SIZE: result = FORMAT_CASE(function, output, test, (size_t)(test)->integer); break; \
+            case ARG_PTRDIFF: result = FORMAT_CASE(function, output, test, (ptrdiff_t)(test)->integer); break; \
+            case ARG_DOUBLE: result = FORMAT_CASE(function, output, test, (double)(test)->real); break; \
+            case ARG_LONG_DOUBLE: result = FORMAT_CASE(function, output, test, (test)->real); break; \
+            case ARG_STRING: result = FORMAT_CASE(function, output, test, (test)->string); break; \
+            case ARG_WIDE_STRING: result = FORMAT_CASE(function, output, test, (test)->wide_string); break; \
+            case ARG_WIDE_CHAR: result = FORMAT_CASE(function, output, test, (test)->wide_char); break; \
+            case ARG_POINTER: result = FORMAT_CASE(function, output, test, (test)->pointer); break; \
+            case ARG_COUNT: result = FORMAT_CASE(function, output, test, count); break;        \
+        }                                                                                      \
+    } while (0)
+
+// Result of running a case through one implementation
+struct outcome {
+    char output[OUTPUT_SIZE + GUARD_SIZE];
+    int result;
+    int count;
+};
+
+static void run_mine(const struct test_case *test, struct outcome *outcome) {
+    int result = 0;
+    memset(outcome->output, 0xEE, sizeof(outcome->output));
+    outcome->count = -1;
+    RUN_CASE(my_snprintf, outcome->output, test, &outcome->count);
+    outcome->result = result;
+}
+
+static void run_reference(const struct test_case *test, struct outcome *outcome) {
+    int result = 0;
+    memset(outcome->output, 0xEE, sizeof(outcome->output));
+    outcome->count = -1;
+    RUN_CASE(snprintf, outcome->output, test, &outcome->count);
+    outcome->result = result;
+}
+
+static int outcomes_match(const struct outcome *mine, const struct outcome *reference) {
+    return mine->result == reference->result && mine->count == reference->count &&
+           memcmp(mine->output, reference->output, sizeof(mine->output)) == 0;
+}
+
+// Print the written part of an output with non-printable bytes escaped
+static void print_escaped(FILE *stream, const struct outcome *outcome, size_t size) {
+    size_t length = 0;
+    while (length < size && length < sizeof(outcome->output) && outcome->output[length]) {
+        length++;
+    }
+    fputc('"', stream);
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = (unsigned char)outcome->output[i];
+        if (c == '"' || c == '\\') fprintf(stream, "\\%c", c);
+        else if (c < 0x20 || c >= 0x7F) fprintf(stream, "\\x%02x", c);
+        else fputc(c, stream);
+    }
+    fputc('"', stream);
+}
+
+static void report_mismatch(FILE *stream, const struct test_case *test, const struct outcome *mine,
+                            const struct outcome *reference) {
+    fprintf(stream, "  format \"%s\" size %zu", test->format, test->size);
+    for (int i = 0; i < test->stars; i++) {
+        fprintf(stream, " *=%d", test->star_values[i]);
+    }
+    switch (test->kind) {
+        case ARG_DOUBLE:
+        case ARG_LONG_DOUBLE: fprintf(stream, " value %a", (double)test->real); break;
+        case ARG_STRING: fprintf(stream, " string %s", test->string ? "set" : "NULL"); break;
+        case ARG_WIDE_CHAR: fprintf(stream, " char U+%04lX", (unsigned long)test->wide_char); break;
+        case ARG_POINTER: fprintf(stream, " pointer %p", test->pointer); break;
+        case ARG_NONE:
+        case ARG_WIDE_STRING:
+        case ARG_COUNT: break;
+        default: fprintf(stream, " value %lld", test->integer); break;
+    }
+    fprintf(stream, "\n    mine   %d ", mine->result);
+    print_escaped(stream, mine, test->size);
+    fprintf(stream, "\n    glibc  %d ", reference->result);
+    print_escaped(stream, reference, test->size);
+    if (test->kind == ARG_COUNT) {
+        fprintf(stream, "\n    %%n     mine %d glibc %d", mine->count, reference->count);
+    }
+    fputc('\n', stream);
+}
+
+// Run one case through both implementations; returns 1 on mismatch
+static int compare_case(const struct test_case *test, struct outcome *mine,
+                        struct outcome *reference) {
+    run_mine(test, mine);
+    run_reference(test, reference);
+    return !outcomes_match(mine, reference);
+}
+
+// Compare one case and report a mismatch; returns 1 on mismatch
+static int check_case(const struct test_case *test, FILE *report) {
+    static struct outcome mine, reference;
+
+    if (!compare_case(test, &mine, &reference)) {
+        return 0;
+    }
+    if (report) {
+        report_mismatch(report, test, &mine, &reference);
+    }
+    return 1;
+}
+
+static const char *gated_conversions(const char *requested, const char *fallback) {
+    if (!requested || !*requested) return fallback;
+    if (strcmp(requested, "all") == 0) return ALL_CONVERSIONS;
+    return requested;
+}
+
+static void set_up_locale(void) {
+    // %ls and %lc in glibc need a UTF-8 locale; without one they are skipped
+    wide_supported = setlocale(LC_ALL, "C.UTF-8") != NULL || setlocale(LC_ALL, "C.utf8") != NULL;
+}
+
+#ifdef MYPRINTF_LIBFUZZER
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    static const char *gated;
+    struct byte_source source = { data, size, 0, 0 };
+    struct test_case test;
+
+    if (!gated) {
+        set_up_locale();
+        gated = gated_conversions(getenv("MYPRINTF_FUZZ_CONVERSIONS"), "");
+    }
+
+    // Ungated conversions only run through my_snprintf, for the sanitizers
+    decode_case(&source, &test, 0);
+    if (!strchr(gated, test.conversion)) {
+        static struct outcome outcome;
+        run_mine(&test, &outcome);
+        return 0;
+    }
+    if (check_case(&test, stderr)) {
+        abort();
+    }
+    return 0;
+}
+
+#else
+
+static double now_nanoseconds(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1e9 + time.tv_nsec;
+}
+
+// Best-of-repeats nanoseconds per call over a fixed set of cases, for mine
+// and for snprintf. The two are timed back to back in every repeat so clock
+// frequency changes affect both alike.
+static void time_cases(const struct test_case *tests, int count, double *mine_ns,
+                       double *reference_ns) {
+    static char output[OUTPUT_SIZE];
+    int result, written;
+
+    *mine_ns = *reference_ns = INFINITY;
+    for (int repeat = 0; repeat < BENCH_REPEATS; repeat++) {
+        double start = now_nanoseconds();
+        for (int call = 0; call < BENCH_CALLS; call++) {
+            for (int i = 0; i < count; i++) {
+                RUN_CASE(my_snprintf, output, &tests[i], &written);
+            }
+        }
+        double middle = now_nanoseconds();
+        for (int call = 0; call < BENCH_CALLS; call++) {
+            for (int i = 0; i < count; i++) {
+                RUN_CASE(snprintf, output, &tests[i], &written);
+            }
+        }
+        double end = now_nanoseconds();
+
+        if ((middle - start) / (BENCH_CALLS * count) < *mine_ns) {
+            *mine_ns = (middle - start) / (BENCH_CALLS * count);
+        }
+        if ((end - middle) / (BENCH_CALLS * count) < *reference_ns) {
+            *reference_ns = (end - middle) / (BENCH_CALLS * count);
+        }
+    }
+    (void)result;
+}
+
+// Per-conversion results of a check run
+struct conversion_stats {
+    long cases;
+    long mismatches;
+    long new_mismatches;
+    long changed;
+    double mine_ns;
+    double reference_ns;
+};
+
+// A recorded check run: timings per conversion, one bit per case that
+// differed from snprintf and, for each of those cases in order, a digest of
+// what my_snprintf produced
+struct baseline {
+    unsigned long long seed;
+    long iterations;
+    int wide;
+    char library[32];
+    double mine_ns[UCHAR_MAX + 1];
+    double reference_ns[UCHAR_MAX + 1];
+    unsigned char *failures;
+    uint32_t *digests;
+    long digest_count;
+};
+
+static int test_bit(const unsigned char *bits, long index) {
+    return (bits[index / 8] >> (index % 8)) & 1;
+}
+
+// FNV-1a digest of my output, guard bytes included, return value and %n count
+static uint32_t outcome_digest(const struct outcome *outcome) {
+    const unsigned char *bytes = (const unsigned char *)outcome->output;
+    int values[2] = { outcome->result, outcome->count };
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < sizeof(outcome->output); i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    bytes = (const unsigned char *)values;
+    for (size_t i = 0; i < sizeof(values); i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Time one conversion against snprintf
+static void time_conversion(uint64_t seed, char conversion, struct conversion_stats *entry) {
+    static struct test_case tests[BENCH_CASES];
+    struct byte_source source = { NULL, 0, 0, seed ^ (uint64_t)conversion };
+
+    for (int i = 0; i < BENCH_CASES; i++) {
+        decode_case(&source, &tests[i], conversion);
+    }
+    time_cases(tests, BENCH_CASES, &entry->mine_ns, &entry->reference_ns);
+}
+
+// Time every conversion against snprintf
+static void run_benchmark(uint64_t seed, struct conversion_stats *stats) {
+    for (const char *conversion = ALL_CONVERSIONS; *conversion; conversion++) {
+        time_conversion(seed, *conversion, &stats[(unsigned char)*conversion]);
+    }
+}
+
+static double time_ratio(const struct conversion_stats *entry) {
+    return entry->reference_ns > 0 ? entry->mine_ns / entry->reference_ns : 0;
+}
+
+// Version of the C library whose snprintf the outputs are compared with
+static const char *reference_library(void) {
+#ifdef __GLIBC__
+    return gnu_get_libc_version();
+#else
+    return "unknown";
+#endif
+}
+
+static int write_baseline(const char *path, uint64_t seed, long iterations,
+                          const struct conversion_stats *stats, const unsigned char *failures,
+                          const uint32_t *digests, long digest_count) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        perror(path);
+        return 1;
+    }
+    fprintf(file, "seed %llu iterations %ld wide %d libc %s\n", (unsigned long long)seed,
+            iterations, wide_supported, reference_library());
+    for (const char *conversion = ALL_CONVERSIONS; *conversion; conversion++) {
+        const struct conversion_stats *entry = &stats[(unsigned char)*conversion];
+        fprintf(file, "%c %ld %ld %.1f %.1f\n", *conversion, entry->cases, entry->mismatches,
+                entry->mine_ns, entry->reference_ns);
+    }
+
+    // The failing cases as a bitmap, 32 bytes of hex per line
+    long bytes = (iterations + 7) / 8;
+    for (long i = 0; i < bytes; i++) {
+        if (i % 32 == 0) fprintf(file, "%sfailures ", i ? "\n" : "");
+        fprintf(file, "%02x", failures[i]);
+    }
+    fputc('\n', file);
+
+    // The digests of the failing cases, eight per line
+    for (long i = 0; i < digest_count; i++) {
+        fprintf(file, "%s%08lx", (i % 8) ? "" : "digests ", (unsigned long)digests[i]);
+        if (i % 8 == 7 || i == digest_count - 1) fputc('\n', file);
+    }
+
+    if (fclose(file) != 0) {
+        perror(path);
+        return 1;
+    }
+    printf("recorded baseline to %s\n", path);
+    return 0;
+}
+
+static int load_baseline(const char *path, struct baseline *baseline) {
+    FILE *file = fopen(path, "r");
+    char line[256];
+    long bytes, filled = 0;
+
+    if (!file) {
+        perror(path);
+        return -1;
+    }
+    if (fscanf(file, "seed %llu iterations %ld wide %d libc %31s\n", &baseline->seed,
+               &baseline->iterations, &baseline->wide, baseline->library) != 4 ||
+        baseline->iterations < 0) {
+        fprintf(stderr, "%s: malformed baseline\n", path);
+        fclose(file);
+        return -1;
+    }
+
+    bytes = (baseline->iterations + 7) / 8;
+    baseline->failures = calloc(bytes + 1, 1);
+    baseline->digests = calloc(baseline->iterations + 1, sizeof(uint32_t));
+    baseline->digest_count = 0;
+    while (fgets(line, sizeof(line), file)) {
+        char name;
+        long cases, mismatches;
+        double mine_ns, reference_ns;
+
+        if (strncmp(line, "failures ", 9) == 0) {
+            for (const char *hex = line + 9; filled < bytes && hex[0] && hex[1] != '\0' &&
+                                             hex[0] != '\n'; hex += 2) {
+                unsigned int value;
+                if (sscanf(hex, "%2x", &value) != 1) break;
+                baseline->failures[filled++] = (unsigned char)value;
+            }
+        } else if (strncmp(line, "digests ", 8) == 0) {
+            for (const char *hex = line + 8; baseline->digest_count < baseline->iterations; hex += 8) {
+                unsigned long value;
+                if (sscanf(hex, "%8lx", &value) != 1) break;
+                baseline->digests[baseline->digest_count++] = (uint32_t)value;
+            }
+        } else if (sscanf(line, "%c %ld %ld %lf %lf", &name, &cases, &mismatches, &mine_ns,
+                          &reference_ns) == 5) {
+            baseline->mine_ns[(unsigned char)name] = mine_ns;
+            baseline->reference_ns[(unsigned char)name] = reference_ns;
+        }
+    }
+    fclose(file);
+
+    if (filled != bytes) {
+        fprintf(stderr, "%s: failure bitmap covers %ld of %ld cases\n", path, filled * 8,
+                baseline->iterations);
+        free(baseline->failures);
+        free(baseline->digests);
+        return -1;
+    }
+
+    long failing = 0;
+    for (long i = 0; i < baseline->iterations; i++) {
+        failing += test_bit(baseline->failures, i);
+    }
+    if (baseline->digest_count != failing) {
+        fprintf(stderr, "%s: %ld digests for %ld failing cases\n", path, baseline->digest_count,
+                failing);
+        free(baseline->failures);
+        free(baseline->digests);
+        return -1;
+    }
+    return 0;
+}
+
+// Replay fuzzer inputs (AFL test cases or a libFuzzer corpus), one per file
+static int replay_files(int count, char **paths, const char *gated) {
+    static uint8_t data[4096];
+    int failures = 0;
+
+    for (int i = 0; i < count; i++) {
+        FILE *file = fopen(paths[i], "rb");
+        if (!file) {
+            perror(paths[i]);
+            return 1;
+        }
+        size_t size = fread(data, 1, sizeof(data), file);
+        fclose(file);
+
+        struct byte_source source = { data, size, 0, 0 };
+        struct test_case test;
+        decode_case(&source, &test, 0);
+        if (!strchr(gated, test.conversion)) {
+            static struct outcome outcome;
+            run_mine(&test, &outcome);
+            continue;
+        }
+
+        if (check_case(&test, stderr)) {
+            fprintf(stderr, "mismatch in %s\n", paths[i]);
+            failures++;
+        }
+    }
+
+    // AFL only notices crashes
+    if (failures) abort();
+    return 0;
+}
+
+static void usage(const char *program) {
+    fprintf(stderr,
+            "usage: %s [-n iterations] [-s seed] [-c conversions|all] [--baseline file]\n"
+            "          [--record] [--threshold ratio] [--no-bench] [file...]\n",
+            program);
+}
+
+int main(int argc, char **argv) {
+    long iterations = 100000;
+    uint64_t seed = 0x9E3779B97F4A7C15ULL;
+    const char *conversions = NULL;
+    const char *baseline_path = NULL;
+    int record = 0;
+    int benchmark = 1;
+    double threshold = 1.30;
+    int argi = 1;
+
+    for (; argi < argc && argv[argi][0] == '-'; argi++) {
+        const char *option = argv[argi];
+        const char *value = (argi + 1 < argc) ? argv[argi + 1] : NULL;
+
+        if (strcmp(option, "--record") == 0) record = 1;
+        else if (strcmp(option, "--no-bench") == 0) benchmark = 0;
+        else if (!value) {
+            usage(argv[0]);
+            return 2;
+        } else {
+            if (strcmp(option, "-n") == 0) iterations = strtol(value, NULL, 10);
+            else if (strcmp(option, "-s") == 0) seed = strtoull(value, NULL, 0);
+            else if (strcmp(option, "-c") == 0) conversions = value;
+            else if (strcmp(option, "--baseline") == 0) baseline_path = value;
+            else if (strcmp(option, "--threshold") == 0) threshold = strtod(value, NULL);
+            else {
+                usage(argv[0]);
+                return 2;
+            }
+            argi++;
+        }
+    }
+
+    set_up_locale();
+    if (argi < argc) {
+        return replay_files(argc - argi, argv + argi, gated_conversions(conversions, ""));
+    }
+
+    struct baseline baseline;
+    int have_baseline = 0;
+    if (baseline_path && !record) {
+        if (load_baseline(baseline_path, &baseline) != 0) {
+            fprintf(stderr, "no usable baseline; record one with --record\n");
+            return 1;
+        }
+        if (baseline.seed != seed || baseline.iterations != iterations) {
+            fprintf(stderr, "%s was recorded with seed %llu and %ld iterations; "
+                    "run with those or re-record\n", baseline_path, baseline.seed,
+                    baseline.iterations);
+            return 1;
+        }
+        // Which cases differ depends on the host: without a UTF-8 locale
+        // %lc and %ls cases are decoded as narrow ones
+        if (baseline.wide != wide_supported || strcmp(baseline.library, reference_library()) != 0) {
+            fprintf(stderr, "%s was recorded with wide conversions %s against libc %s; this host "
+                    "has them %s and libc %s\n", baseline_path, baseline.wide ? "on" : "off",
+                    baseline.library, wide_supported ? "on" : "off", reference_library());
+            return 1;
+        }
+        have_baseline = 1;
+    }
+
+    // The seed is never zero, which would stall the generator
+    struct byte_source source = { NULL, 0, 0, seed ? seed : 1 };
+    static struct conversion_stats stats[UCHAR_MAX + 1];
+    unsigned char *failures = calloc((iterations + 7) / 8 + 1, 1);
+    uint32_t *digests = calloc(iterations + 1, sizeof(uint32_t));
+    const char *gated = gated_conversions(conversions, "");
+    long digest_count = 0, known_index = 0;
+    long new_mismatches = 0, changed = 0, fixed = 0, reported = 0;
+    int regressions = 0;
+
+    for (long i = 0; i < iterations; i++) {
+        static struct outcome mine, reference;
+        struct test_case test;
+        decode_case(&source, &test, 0);
+
+        struct conversion_stats *entry = &stats[(unsigned char)test.conversion];
+        int known = have_baseline && test_bit(baseline.failures, i);
+        uint32_t expected = known ? baseline.digests[known_index++] : 0;
+
+        entry->cases++;
+        if (!compare_case(&test, &mine, &reference)) {
+            fixed += known;
+            continue;
+        }
+
+        uint32_t digest = outcome_digest(&mine);
+        failures[i / 8] |= 1 << (i % 8);
+        digests[digest_count++] = digest;
+        entry->mismatches++;
+
+        // Against a baseline a case is reported when it newly differs from
+        // snprintf or my output for it changed; without one, the first few
+        // mismatches of each conversion are
+        const char *change = NULL;
+        if (have_baseline && !known) {
+            change = "newly differs";
+            entry->new_mismatches++;
+            new_mismatches++;
+        } else if (known && digest != expected) {
+            change = "output changed";
+            entry->changed++;
+            changed++;
+        }
+        if (change && reported++ < MAX_NEW_REPORTS) {
+            printf("%%%c %s:\n", test.conversion, change);
+            report_mismatch(stdout, &test, &mine, &reference);
+        } else if (!have_baseline && entry->mismatches <= MAX_REPORTS) {
+            if (entry->mismatches == 1) {
+                printf("%%%c mismatches:\n", test.conversion);
+            }
+            report_mismatch(stdout, &test, &mine, &reference);
+        }
+    }
+    if (benchmark) {
+        run_benchmark(seed, stats);
+    }
+
+    printf("\n%-4s %8s %10s %6s %8s %6s %10s %10s %7s %9s\n", "conv", "cases", "mismatches",
+           "new", "changed", "exact", "mine ns", "glibc ns", "ratio", "baseline");
+    for (const char *conversion = ALL_CONVERSIONS; *conversion; conversion++) {
+        unsigned char index = (unsigned char)*conversion;
+        struct conversion_stats *entry = &stats[index];
+        int exact = strchr(gated, *conversion) != NULL;
+        double previous = (have_baseline && baseline.reference_ns[index] > 0) ?
+                          baseline.mine_ns[index] / baseline.reference_ns[index] : 0;
+
+        // A single slow timing is often noise from the host, so a conversion
+        // only counts as slower when every retry confirms it
+        for (int retry = 0; benchmark && retry < BENCH_RETRIES &&
+                            time_ratio(entry) > previous * threshold && previous > 0; retry++) {
+            struct conversion_stats again = *entry;
+            time_conversion(seed, *conversion, &again);
+            if (time_ratio(&again) < time_ratio(entry)) {
+                *entry = again;
+            }
+        }
+        double ratio = time_ratio(entry);
+        int slower = ratio > 0 && previous > 0 && ratio > previous * threshold;
+
+        printf("%%%-3c %8ld %10ld %6ld %8ld %6s %10.1f %10.1f %7.2f %9.2f%s%s\n", *conversion,
+               entry->cases, entry->mismatches, entry->new_mismatches, entry->changed,
+               exact ? "yes" : "no",
+               entry->mine_ns, entry->reference_ns, ratio, previous,
+               (exact && entry->mismatches) ? "  not exact" : "", slower ? "  slower" : "");
+        regressions += (exact && entry->mismatches) + slower + (entry->new_mismatches > 0) +
+                       (entry->changed > 0);
+    }
+
+    if (have_baseline) {
+        printf("%ld case(s) newly differ from snprintf, %ld changed output, %ld newly match\n",
+               new_mismatches, changed, fixed);
+        if (changed) {
+            printf("if the changed output is intended, re-record with --record\n");
+        } else if (fixed && !new_mismatches) {
+            printf("re-record with --record to lock the fixes in\n");
+        }
+        free(baseline.failures);
+        free(baseline.digests);
+    }
+    if (record && baseline_path) {
+        regressions += write_baseline(baseline_path, seed, iterations, stats, failures, digests,
+                                      digest_count);
+    }
+    printf("%d regression(s)\n", regressions);
+
+    free(failures);
+    free(digests);
+    return regressions ? 1 : 0;
+}
+
+#endif
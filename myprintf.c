@@ -1,3 +1,7 @@
+#if defined(MYPRINTF_PROFILE) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
@@ -7,93 +11,215 @@
 #include <stdint.h>
 #include <errno.h>
 #include <stddef.h>
-
-// Constants for buffer sizes
+#include <wchar.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#ifdef MYPRINTF_PROFILE
+#ifndef __linux__
+#error "MYPRINTF_PROFILE needs Linux perf_event_open"
+#endif
+#include <limits.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Constants for buffer sizes. Building with -DMYPRINTF_LEAN_STACK drops the
+// output and field buffers: fields are sized with a counting pass and then
+// streamed, and my_printf flushes a SINK_CHUNK_SIZE buffer as it fills.
 #define MAX_OUTPUT_SIZE 8192
 #define TEMP_BUFFER_SIZE 2048
+#define SINK_CHUNK_SIZE 128
+
+// Destination for formatted bytes. Bytes land in buffer while it has room;
+// a stream sink flushes a full buffer, any other sink drops the excess, and
+// total counts every byte either way. Between sink_trim_begin and
+// sink_trim_end a sink holds back zeros after a '.' and drops them (and a
+// bare '.') if they turn out to be trailing, which is how %g trims its
+// candidates.
+struct sink {
+    char *buffer;
+    size_t capacity;
+    size_t position;
+    size_t total;
+    FILE *stream;
+    size_t pending_zeros;
+    char failed;
+    char trim_zeros;
+    char seen_point;
+    char pending_point;
+};
+
+// A sink writing into buffer[0..capacity); capacity 0 only counts
+static struct sink sink_for_buffer(char *buffer, size_t capacity) {
+    struct sink sink = {0};
+    sink.buffer = buffer;
+    sink.capacity = capacity;
+    return sink;
+}
 
-// Helper function to reverse a string
-static void reverse_string(char *str, int length) {
-    for (int i = 0, j = length - 1; i < j; i++, j--) {
-        char temp = str[i];
-        str[i] = str[j];
-        str[j] = temp;
+// Write any buffered bytes to the stream
+static void sink_flush(struct sink *sink) {
+    if (sink->stream && sink->position > 0) {
+        if (fwrite(sink->buffer, 1, sink->position, sink->stream) != sink->position) {
+            sink->failed = 1;
+        }
+        sink->position = 0;
     }
 }
 
-// Convert an integer to a string in the specified base
-static int integer_to_string(uintmax_t value, char *buffer, int base, int use_uppercase, 
-    int is_signed, int is_negative, int min_digits) {
-    // Mark unused parameter to suppress the warning
-    (void)is_signed;
+// Append length bytes, bypassing trimming
+static void sink_append(struct sink *sink, const char *bytes, size_t length) {
+    sink->total += length;
+    while (length > 0) {
+        if (sink->position == sink->capacity) {
+            if (!sink->stream) return;
+            sink_flush(sink);
+        }
+        size_t room = sink->capacity - sink->position;
+        size_t count = (length < room) ? length : room;
+        memcpy(sink->buffer + sink->position, bytes, count);
+        sink->position += count;
+        bytes += count;
+        length -= count;
+    }
+}
+
+// Append one byte
+static void sink_put(struct sink *sink, char c) {
+    if (!sink->trim_zeros) {
+        if (sink->position < sink->capacity) {
+            sink->buffer[sink->position++] = c;
+            sink->total++;
+        } else {
+            sink_append(sink, &c, 1);
+        }
+        return;
+    }
+
+    if (c == '.') {
+        sink->seen_point = 1;
+        sink->pending_point = 1;
+        return;
+    }
+    if (c == '0' && sink->seen_point) {
+        sink->pending_zeros++;
+        return;
+    }
+    if (sink->pending_point) {
+        sink_append(sink, ".", 1);
+        sink->pending_point = 0;
+    }
+    for (; sink->pending_zeros > 0; sink->pending_zeros--) {
+        sink_append(sink, "0", 1);
+    }
+    sink_append(sink, &c, 1);
+}
 
-const char *digits = use_uppercase ? "0123456789ABCDEF" : "0123456789abcdef";
-int position = 0;
+// Append length bytes
+static void sink_write(struct sink *sink, const char *bytes, size_t length) {
+    if (sink->trim_zeros) {
+        for (size_t i = 0; i < length; i++) {
+            sink_put(sink, bytes[i]);
+        }
+        return;
+    }
+    sink_append(sink, bytes, length);
+}
 
-// Rest of the function remains the same...
+// Start trimming trailing fractional zeros
+static void sink_trim_begin(struct sink *sink) {
+    sink->trim_zeros = 1;
+    sink->seen_point = 0;
+    sink->pending_point = 0;
+    sink->pending_zeros = 0;
+}
+
+// Stop trimming; anything still held back was trailing and is dropped
+static void sink_trim_end(struct sink *sink) {
+    sink->trim_zeros = 0;
+    sink->pending_point = 0;
+    sink->pending_zeros = 0;
+}
+
+// Append count copies of c
+static void sink_fill(struct sink *sink, char c, int count) {
+    for (int i = 0; i < count; i++) {
+        sink_put(sink, c);
+    }
+}
+
+// Convert an integer to a string in the specified base
+static void integer_to_sink(struct sink *sink, uintmax_t value, int base, int use_uppercase,
+                            int is_negative, int min_digits) {
+    const char *digits = use_uppercase ? "0123456789ABCDEF" : "0123456789abcdef";
+    char buffer[sizeof(uintmax_t) * 3];
+    int position = sizeof(buffer);
 
     // Handle zero with zero precision
     if (value == 0 && min_digits == 0) {
-        buffer[position] = '\0';
-        return 0;
+        return;
     }
 
-    // Convert number to digits
+    // Convert number to digits, filling the buffer from the end
     if (value == 0) {
-        buffer[position++] = '0';
+        buffer[--position] = '0';
     } else {
         while (value) {
-            buffer[position++] = digits[value % base];
+            buffer[--position] = digits[value % base];
             value /= base;
         }
     }
 
-    // Add leading zeros if needed
-    while (position < min_digits) {
-        buffer[position++] = '0';
-    }
-
-    // Add negative sign if needed
+    // Add negative sign and leading zeros if needed
     if (is_negative) {
-        buffer[position++] = '-';
+        sink_put(sink, '-');
     }
+    sink_fill(sink, '0', min_digits - (int)(sizeof(buffer) - position));
+    sink_write(sink, buffer + position, sizeof(buffer) - position);
+}
 
-    buffer[position] = '\0';
-    reverse_string(buffer, position);
-    return position;
+// Write nan or inf; returns 0 for finite values
+static int nonfinite_to_sink(struct sink *sink, double value, int use_uppercase) {
+    if (isnan(value)) {
+        sink_write(sink, use_uppercase ? "NAN" : "nan", 3);
+        return 1;
+    }
+    if (isinf(value)) {
+        if (value < 0) {
+            sink_put(sink, '-');
+        }
+        sink_write(sink, use_uppercase ? "INF" : "inf", 3);
+        return 1;
+    }
+    return 0;
 }
 
 // Convert a floating-point number to a string
-static int float_to_string(double value, char *buffer, int precision, int format_flags, 
-                         int use_uppercase) {
-    int length = 0;
+static void float_to_sink(struct sink *sink, double value, int precision, int format_flags,
+                          int use_uppercase) {
     int is_negative = value < 0;
 
     // Handle special cases: NaN and Infinity
-    if (isnan(value)) {
-        strcpy(buffer, use_uppercase ? "NAN" : "nan");
-        return 3;
-    }
-    if (isinf(value)) {
-        strcpy(buffer, is_negative ? (use_uppercase ? "-INF" : "-inf") : 
-                                     (use_uppercase ? "INF" : "inf"));
-        return is_negative ? 4 : 3;
+    if (nonfinite_to_sink(sink, value, use_uppercase)) {
+        return;
     }
 
     // Handle sign flags
     if (is_negative) {
         value = -value;
     } else if (format_flags & 0x01) { // '+' flag
-        *buffer++ = '+';
-        length++;
+        sink_put(sink, '+');
     } else if (format_flags & 0x02) { // ' ' flag
-        *buffer++ = ' ';
-        length++;
+        sink_put(sink, ' ');
     }
 
     if (is_negative) {
-        *buffer++ = '-';
-        length++;
+        sink_put(sink, '-');
     }
 
     // Default precision is 6 if not specified
@@ -107,80 +233,56 @@ static int float_to_string(double value, char *buffer, int precision, int format
     double fractional_part = rounded - integer_part;
 
     // Convert integer part
-    length += integer_to_string(integer_part, buffer, 10, 0, 0, 0, 0);
-    buffer += strlen(buffer);
+    integer_to_sink(sink, integer_part, 10, 0, 0, 0);
 
-    // Add decimal point and fractional part if needed
+    // Add decimal point and fractional part if needed; digits are produced
+    // one at a time, so a large precision never needs a buffer
     if (precision > 0 || (format_flags & 0x10)) { // '#' flag ensures decimal point
-        *buffer++ = '.';
-        length++;
+        sink_put(sink, '.');
 
         for (int i = 0; i < precision; i++) {
             fractional_part *= 10.0;
             int digit = (int)fractional_part;
-            *buffer++ = '0' + digit;
+            sink_put(sink, '0' + digit);
             fractional_part -= digit;
-            length++;
         }
     }
-
-    *buffer = '\0';
-    return length;
 }
 
 // Convert a number to scientific notation
-static int scientific_to_string(double value, char *buffer, int precision, 
-                              int use_uppercase, int format_flags) {
-    int length = 0;
+static void scientific_to_sink(struct sink *sink, double value, int precision,
+                               int use_uppercase, int format_flags) {
     int is_negative = value < 0;
     int exponent = 0;
 
     // Handle special cases
-    if (isnan(value)) {
-        strcpy(buffer, use_uppercase ? "NAN" : "nan");
-        return 3;
-    }
-    if (isinf(value)) {
-        strcpy(buffer, is_negative ? (use_uppercase ? "-INF" : "-inf") : 
-                                     (use_uppercase ? "INF" : "inf"));
-        return is_negative ? 4 : 3;
+    if (nonfinite_to_sink(sink, value, use_uppercase)) {
+        return;
     }
 
     // Handle signs
     if (is_negative) {
         value = -value;
     } else if (format_flags & 0x01) {
-        *buffer++ = '+';
-        length++;
+        sink_put(sink, '+');
     } else if (format_flags & 0x02) {
-        *buffer++ = ' ';
-        length++;
+        sink_put(sink, ' ');
     }
 
     if (is_negative) {
-        *buffer++ = '-';
-        length++;
+        sink_put(sink, '-');
     }
 
     // Handle zero
     if (value == 0.0) {
-        *buffer++ = '0';
-        length++;
+        sink_put(sink, '0');
         if (precision > 0 || (format_flags & 0x10)) {
-            *buffer++ = '.';
-            length++;
-            for (int i = 0; i < precision; i++) {
-                *buffer++ = '0';
-                length++;
-            }
+            sink_put(sink, '.');
+            sink_fill(sink, '0', precision);
         }
-        *buffer++ = use_uppercase ? 'E' : 'e';
-        *buffer++ = '+';
-        *buffer++ = '0';
-        *buffer++ = '0';
-        length += 4;
-        *buffer = '\0';
-        return length;
+        sink_put(sink, use_uppercase ? 'E' : 'e');
+        sink_write(sink, "+00", 3);
+        return;
     }
 
     // Normalize to range [1, 10)
@@ -202,69 +304,52 @@ static int scientific_to_string(double value, char *buffer, int precision,
     double fractional_part = rounded - integer_part;
 
     // Convert mantissa
-    *buffer++ = '0' + integer_part;
-    length++;
+    sink_put(sink, '0' + integer_part);
 
     if (precision > 0 || (format_flags & 0x10)) {
-        *buffer++ = '.';
-        length++;
+        sink_put(sink, '.');
         for (int i = 0; i < precision; i++) {
             fractional_part *= 10.0;
             int digit = (int)fractional_part;
-            *buffer++ = '0' + digit;
+            sink_put(sink, '0' + digit);
             fractional_part -= digit;
-            length++;
         }
     }
 
     // Add exponent
-    *buffer++ = use_uppercase ? 'E' : 'e';
-    length++;
-    *buffer++ = (exponent >= 0) ? '+' : '-';
-    length++;
+    sink_put(sink, use_uppercase ? 'E' : 'e');
+    sink_put(sink, (exponent >= 0) ? '+' : '-');
     if (exponent < 0) exponent = -exponent;
     if (exponent < 10) {
-        *buffer++ = '0';
-        length++;
+        sink_put(sink, '0');
     }
-    length += integer_to_string(exponent, buffer, 10, 0, 0, 0, 0);
-    return length;
+    integer_to_sink(sink, exponent, 10, 0, 0, 0);
 }
 
 // Convert a number to hexadecimal floating-point format
-static int hex_float_to_string(double value, char *buffer, int precision, 
-                             int use_uppercase, int format_flags) {
-    int length = 0;
+static void hex_float_to_sink(struct sink *sink, double value, int precision,
+                              int use_uppercase, int format_flags) {
     int is_negative = value < 0;
     int exponent = 0;
 
     // Handle special cases
-    if (isnan(value)) {
-        strcpy(buffer, use_uppercase ? "NAN" : "nan");
-        return 3;
-    }
-    if (isinf(value)) {
-        strcpy(buffer, is_negative ? (use_uppercase ? "-INF" : "-inf") : 
-                                     (use_uppercase ? "INF" : "inf"));
-        return is_negative ? 4 : 3;
+    if (nonfinite_to_sink(sink, value, use_uppercase)) {
+        return;
     }
 
     if (value == 0.0) {
-        strcpy(buffer, use_uppercase ? "0X0.0P+0" : "0x0.0p+0");
-        return 7;
+        sink_write(sink, use_uppercase ? "0X0.0P+0" : "0x0.0p+0", 8);
+        return;
     }
 
     // Handle signs
     if (is_negative) {
-        *buffer++ = '-';
-        length++;
+        sink_put(sink, '-');
         value = -value;
     } else if (format_flags & 0x01) {
-        *buffer++ = '+';
-        length++;
+        sink_put(sink, '+');
     } else if (format_flags & 0x02) {
-        *buffer++ = ' ';
-        length++;
+        sink_put(sink, ' ');
     }
 
     // Normalize to [1, 2)
@@ -287,39 +372,37 @@ static int hex_float_to_string(double value, char *buffer, int precision,
     double fractional_part = rounded - integer_part;
 
     // Convert hexadecimal format
-    *buffer++ = '0';
-    *buffer++ = use_uppercase ? 'X' : 'x';
-    *buffer++ = '1';
-    length += 3;
+    sink_put(sink, '0');
+    sink_put(sink, use_uppercase ? 'X' : 'x');
+    sink_put(sink, '1');
 
     if (precision > 0 || (format_flags & 0x10)) {
-        *buffer++ = '.';
-        length++;
+        sink_put(sink, '.');
         for (int i = 0; i < precision; i++) {
             fractional_part *= 16.0;
             int digit = (int)fractional_part;
-            *buffer++ = digit < 10 ? '0' + digit : 
-                                     (use_uppercase ? 'A' + digit - 10 : 'a' + digit - 10);
+            sink_put(sink, digit < 10 ? '0' + digit :
+                                        (use_uppercase ? 'A' + digit - 10 : 'a' + digit - 10));
             fractional_part -= digit;
-            length++;
         }
     }
 
     // Add exponent
-    *buffer++ = use_uppercase ? 'P' : 'p';
-    length++;
-    *buffer++ = (exponent >= 0) ? '+' : '-';
-    length++;
+    sink_put(sink, use_uppercase ? 'P' : 'p');
+    sink_put(sink, (exponent >= 0) ? '+' : '-');
     if (exponent < 0) exponent = -exponent;
-    length += integer_to_string(exponent, buffer, 10, 0, 0, 0, 0);
-    return length;
+    integer_to_sink(sink, exponent, 10, 0, 0, 0);
 }
 
-// Choose shortest representation between float and scientific notation
-static int shortest_float_to_string(double value, char *buffer, int precision, 
-                                  int use_uppercase, int format_flags) {
-    char scientific_buffer[512], float_buffer[512];
-    int scientific_length, float_length;
+// Choose shortest representation between float and scientific notation.
+// Both candidates are measured with a counting sink and only the winner is
+// written, so no candidate buffers are needed.
+static void shortest_float_to_sink(struct sink *sink, double value, int precision,
+                                   int use_uppercase, int format_flags) {
+    // Remove trailing zeros unless '#' flag is set
+    int trim_zeros = !(format_flags & 0x10);
+    struct sink counter;
+    size_t scientific_length;
 
     if (precision < 0) {
         precision = 6;
@@ -328,305 +411,860 @@ static int shortest_float_to_string(double value, char *buffer, int precision,
         precision = 1; // %g requires at least one significant digit
     }
 
-    // Get both representations
-    scientific_length = scientific_to_string(value, scientific_buffer, precision - 1, 
-                                           use_uppercase, format_flags);
-    float_length = float_to_string(value, float_buffer, precision - 1, format_flags, 
-                                  use_uppercase);
+    // Measure both representations
+    counter = sink_for_buffer(NULL, 0);
+    if (trim_zeros) sink_trim_begin(&counter);
+    scientific_to_sink(&counter, value, precision - 1, use_uppercase, format_flags);
+    scientific_length = counter.total;
 
-    // Remove trailing zeros unless '#' flag is set
-    if (!(format_flags & 0x10)) {
-        char *ptr = scientific_buffer;
-        if (strchr(scientific_buffer, '.')) {
-            while (*ptr) ptr++;
-            ptr--;
-            while (*ptr == '0') ptr--;
-            if (*ptr == '.') ptr--;
-            ptr[1] = '\0';
-            scientific_length = ptr - scientific_buffer + 1;
-        }
-        ptr = float_buffer;
-        if (strchr(float_buffer, '.')) {
-            while (*ptr) ptr++;
-            ptr--;
-            while (*ptr == '0') ptr--;
-            if (*ptr == '.') ptr--;
-            ptr[1] = '\0';
-            float_length = ptr - float_buffer + 1;
-        }
-    }
-
-    // Choose shorter representation
-    if (scientific_length <= float_length) {
-        strcpy(buffer, scientific_buffer);
-        return scientific_length;
+    counter = sink_for_buffer(NULL, 0);
+    if (trim_zeros) sink_trim_begin(&counter);
+    float_to_sink(&counter, value, precision - 1, format_flags, use_uppercase);
+
+    // Write the shorter representation
+    if (trim_zeros) sink_trim_begin(sink);
+    if (scientific_length <= counter.total) {
+        scientific_to_sink(sink, value, precision - 1, use_uppercase, format_flags);
     } else {
-        strcpy(buffer, float_buffer);
-        return float_length;
+        float_to_sink(sink, value, precision - 1, format_flags, use_uppercase);
     }
+    if (trim_zeros) sink_trim_end(sink);
 }
 
 // Convert a pointer to a string
-static int pointer_to_string(void *pointer, char *buffer) {
-    *buffer++ = '0';
-    *buffer++ = 'x';
-    return 2 + integer_to_string((uintptr_t)pointer, buffer, 16, 0, 0, 0, 0);
+static void pointer_to_sink(struct sink *sink, void *pointer) {
+    sink_write(sink, "0x", 2);
+    integer_to_sink(sink, (uintptr_t)pointer, 16, 0, 0, 0);
 }
 
-// Main formatting function
-int my_vsnprintf(char *output, size_t max_size, const char *format, va_list arguments) {
-    char *current_output = output;
-    size_t total_chars_written = 0;
-    size_t actual_chars_written = 0;
+// Length of the leading run of ASCII bytes in str[0..length)
+static size_t ascii_prefix_length(const unsigned char *str, size_t length) {
+    size_t position = 0;
 
-    if (max_size == 0) return 0;
-    if (max_size == 1) {
-        *output = '\0';
+#if defined(__SSE2__)
+    // Sixteen bytes per step: the sign bits of each lane flag non-ASCII bytes
+    for (; position + 16 <= length; position += 16) {
+        int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(str + position)));
+        if (mask) {
+            return position + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; position + 8 <= length; position += 8) {
+        uint64_t word;
+        memcpy(&word, str + position, sizeof(word));
+        if (word & 0x8080808080808080ULL) break;
+    }
+    while (position < length && str[position] < 0x80) {
+        position++;
+    }
+    return position;
+}
+
+// Length of the well-formed UTF-8 sequence at str, or 0 if it is malformed.
+// Continuation bytes are read in order and the check stops at the first byte
+// that is not one, so it never reads past a terminating NUL.
+static int utf8_sequence_length(const unsigned char *str, size_t length) {
+    unsigned char lead = str[0];
+    size_t needed;
+
+    if (lead < 0x80) return 1;
+    if (lead >= 0xC2 && lead <= 0xDF) needed = 2;
+    else if ((lead & 0xF0) == 0xE0) needed = 3;
+    else if (lead >= 0xF0 && lead <= 0xF4) needed = 4;
+    else return 0;
+
+    if (length < needed) return 0;
+    for (size_t i = 1; i < needed; i++) {
+        if ((str[i] & 0xC0) != 0x80) return 0;
+    }
+
+    // Reject overlong forms, surrogates and values beyond U+10FFFF
+    if (lead == 0xE0 && str[1] < 0xA0) return 0;
+    if (lead == 0xED && str[1] > 0x9F) return 0;
+    if (lead == 0xF0 && str[1] < 0x90) return 0;
+    if (lead == 0xF4 && str[1] > 0x8F) return 0;
+    return (int)needed;
+}
+
+// Walk str[0..length) and stop after max_points code points. Multibyte
+// sequences are checked against str[0..readable), so one may run past
+// length. Returns the number of bytes covered and stores the code point
+// count in *points. A malformed byte counts as one code point, so a broken
+// string is measured by its bytes instead of being rejected.
+static size_t utf8_span_within(const char *str, size_t length, size_t readable,
+                               size_t max_points, size_t *points) {
+    const unsigned char *bytes = (const unsigned char *)str;
+    size_t position = 0;
+    size_t count = 0;
+
+    while (position < length && count < max_points) {
+        size_t limit = length - position;
+        if (limit > max_points - count) {
+            limit = max_points - count;
+        }
+        size_t run = ascii_prefix_length(bytes + position, limit);
+        position += run;
+        count += run;
+        if (run == limit) continue;
+
+        int sequence = utf8_sequence_length(bytes + position, readable - position);
+        position += sequence ? sequence : 1;
+        count++;
+    }
+
+    *points = count;
+    return position;
+}
+
+static size_t utf8_span(const char *str, size_t length, size_t max_points, size_t *points) {
+    return utf8_span_within(str, length, length, max_points, points);
+}
+
+// Like utf8_span, for a NUL-terminated string that may also end without a
+// terminator after its max_points-th code point. Every code point covers at
+// least one byte, so the first max_points bytes are spanned with the vector
+// kernels; only code points beyond them are walked a byte at a time, never
+// past the NUL or the last code point covered.
+static size_t utf8_span_terminated(const char *str, size_t max_points, size_t *points) {
+    const unsigned char *bytes = (const unsigned char *)str;
+    const char *end = memchr(str, '\0', max_points);
+    size_t count;
+
+    if (end) {
+        return utf8_span(str, (size_t)(end - str), max_points, points);
+    }
+
+    // No NUL in the prefix: a sequence may straddle its end, which is safe
+    // because utf8_sequence_length stops at the first non-continuation byte
+    size_t position = utf8_span_within(str, max_points, SIZE_MAX, max_points, &count);
+    while (count < max_points && bytes[position]) {
+        if (bytes[position] < 0x80) {
+            position++;
+        } else {
+            int sequence = utf8_sequence_length(bytes + position, 4);
+            position += sequence ? sequence : 1;
+        }
+        count++;
+    }
+
+    *points = count;
+    return position;
+}
+
+// Number of bytes utf8_encode produces for a code point
+static int utf8_encoded_length(uint32_t code_point) {
+    if (code_point < 0x80) return 1;
+    if (code_point < 0x800) return 2;
+    if (code_point < 0x10000) return 3;
+    if (code_point <= 0x10FFFF) return 4;
+    return 3; // U+FFFD
+}
+
+// Encode a code point as UTF-8; surrogates and out-of-range values become U+FFFD
+static int utf8_encode(uint32_t code_point, char *buffer) {
+    if ((code_point >= 0xD800 && code_point <= 0xDFFF) || code_point > 0x10FFFF) {
+        code_point = 0xFFFD;
+    }
+
+    if (code_point < 0x80) {
+        buffer[0] = (char)code_point;
+        return 1;
+    }
+    if (code_point < 0x800) {
+        buffer[0] = (char)(0xC0 | (code_point >> 6));
+        buffer[1] = (char)(0x80 | (code_point & 0x3F));
+        return 2;
+    }
+    if (code_point < 0x10000) {
+        buffer[0] = (char)(0xE0 | (code_point >> 12));
+        buffer[1] = (char)(0x80 | ((code_point >> 6) & 0x3F));
+        buffer[2] = (char)(0x80 | (code_point & 0x3F));
+        return 3;
+    }
+    buffer[0] = (char)(0xF0 | (code_point >> 18));
+    buffer[1] = (char)(0x80 | ((code_point >> 12) & 0x3F));
+    buffer[2] = (char)(0x80 | ((code_point >> 6) & 0x3F));
+    buffer[3] = (char)(0x80 | (code_point & 0x3F));
+    return 4;
+}
+
+// Measure the UTF-8 encoding of a wide string. Stops at the terminator, after
+// max_points characters, or before a character that would take the encoding
+// past max_bytes (a precision never splits a character). Stores the number of
+// wide characters consumed in *count and returns the encoded length.
+static size_t wide_utf8_length(const wchar_t *str, size_t max_points, size_t max_bytes,
+                               size_t *count) {
+    size_t length = 0;
+    size_t i = 0;
+
+    for (; i < max_points && str[i]; i++) {
+        size_t encoded = utf8_encoded_length((uint32_t)str[i]);
+        if (length + encoded > max_bytes) break;
+        length += encoded;
+    }
+
+    *count = i;
+    return length;
+}
+
+// Transcode count wide characters to UTF-8; buffer needs room for 4 * count bytes
+static size_t wide_to_utf8(const wchar_t *str, size_t count, char *buffer) {
+    size_t i = 0;
+    size_t position = 0;
+
+    while (i < count) {
+#if defined(__SSE2__) && WCHAR_MAX > 0xFFFF
+        // Narrow eight ASCII characters at once with two saturating packs
+        if (i + 8 <= count) {
+            __m128i low = _mm_loadu_si128((const __m128i *)(str + i));
+            __m128i high = _mm_loadu_si128((const __m128i *)(str + i + 4));
+            __m128i upper_bits = _mm_and_si128(_mm_or_si128(low, high), _mm_set1_epi32(~0x7F));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi32(upper_bits, _mm_setzero_si128())) == 0xFFFF) {
+                __m128i words = _mm_packs_epi32(low, high);
+                _mm_storel_epi64((__m128i *)(buffer + position), _mm_packus_epi16(words, words));
+                i += 8;
+                position += 8;
+                continue;
+            }
+        }
+#endif
+        position += utf8_encode((uint32_t)str[i++], buffer + position);
+    }
+    return position;
+}
+
+// Append a string field to the sink. Wide fields hold count wide characters
+// and are transcoded through a small chunk buffer; narrow fields hold count
+// bytes.
+static void write_field(struct sink *sink, const char *field, const wchar_t *wide_field,
+                        size_t count) {
+    char chunk[64];
+
+    if (!wide_field) {
+        sink_write(sink, field, count);
+        return;
+    }
+    for (size_t done = 0; done < count; ) {
+        size_t batch = (count - done < sizeof(chunk) / 4) ? count - done : sizeof(chunk) / 4;
+        sink_write(sink, chunk, wide_to_utf8(wide_field + done, batch, chunk));
+        done += batch;
+    }
+}
+
+// Length modifiers
+enum length_modifier { NONE, HH, H, L, LL, J, Z, T, LONG_DOUBLE };
+
+// A parsed conversion specification
+struct format_spec {
+    int flags;
+    int width;
+    int precision;
+    enum length_modifier length_modifier;
+    char specifier;
+};
+
+// The argument consumed by a numeric conversion
+union format_argument {
+    intmax_t signed_value;
+    uintmax_t unsigned_value;
+    double float_value;
+    void *pointer;
+};
+
+// Render a numeric or literal conversion into sink. Rendering has no side
+// effects, so a field can be rendered twice: once into a counting sink to size
+// its padding, then into the output.
+static void render_field(struct sink *sink, const struct format_spec *spec,
+                         union format_argument argument) {
+    int format_flags = spec->flags;
+    int precision = spec->precision;
+    char specifier = spec->specifier;
+
+    switch (specifier) {
+        case 'd':
+        case 'i': {
+            int is_negative = argument.signed_value < 0;
+            uintmax_t abs_value = is_negative ? -(uintmax_t)argument.signed_value
+                                              : (uintmax_t)argument.signed_value;
+
+            if (!is_negative) {
+                if (format_flags & 0x01) sink_put(sink, '+');
+                else if (format_flags & 0x02) sink_put(sink, ' ');
+            }
+            integer_to_sink(sink, abs_value, 10, 0, is_negative, precision);
+            break;
+        }
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'o': {
+            uintmax_t value = argument.unsigned_value;
+            int base = (specifier == 'u') ? 10 : (specifier == 'o') ? 8 : 16;
+            int use_uppercase = (specifier == 'X');
+
+            if ((format_flags & 0x10) && value != 0) {
+                if (specifier == 'o') {
+                    sink_put(sink, '0');
+                } else if (specifier == 'x' || specifier == 'X') {
+                    sink_put(sink, '0');
+                    sink_put(sink, use_uppercase ? 'X' : 'x');
+                }
+            }
+            integer_to_sink(sink, value, base, use_uppercase, 0, precision);
+            break;
+        }
+        case 'p': {
+            pointer_to_sink(sink, argument.pointer);
+            break;
+        }
+        case 'n': {
+            break;
+        }
+        case 'f':
+        case 'F': {
+            float_to_sink(sink, argument.float_value, precision, format_flags,
+                          (specifier == 'F'));
+            break;
+        }
+        case 'e':
+        case 'E': {
+            scientific_to_sink(sink, argument.float_value, precision,
+                               (specifier == 'E'), format_flags);
+            break;
+        }
+        case 'g':
+        case 'G': {
+            shortest_float_to_sink(sink, argument.float_value, precision,
+                                   (specifier == 'G'), format_flags);
+            break;
+        }
+        case 'a':
+        case 'A': {
+            hex_float_to_sink(sink, argument.float_value, precision,
+                              (specifier == 'A'), format_flags);
+            break;
+        }
+        case '%': {
+            sink_put(sink, '%');
+            break;
+        }
+        default: {
+            sink_put(sink, '%');
+            sink_put(sink, specifier);
+        }
+    }
+}
+
+#ifdef MYPRINTF_PROFILE
+// Hardware counter profiling (Linux only). Each conversion, from its '%'
+// through padding, is bracketed by reads of a perf_event_open counter group
+// and the deltas are summed per converter and per conversion site, a site
+// being a format string address, the text found there and the offset of the
+// '%' in it, so formats built one after another in a reused buffer stay
+// apart. The totals
+// are written at exit to $MYPRINTF_PROFILE (default myprintf.profile) for
+// profile_report to rank. Counters the kernel refuses read as zero; the
+// task-clock fallback for machines without hardware counters also counts
+// the counter reads themselves, so it only ranks coarsely. Counters
+// follow the thread that formats first, and the tables are not locked, so
+// profile one formatting thread at a time.
+
+#define PROFILE_COUNTERS 5
+#define PROFILE_SITES 1024
+#define PROFILE_PROBES 16
+
+struct profile_totals {
+    uint64_t calls;
+    uint64_t counters[PROFILE_COUNTERS];
+};
+
+struct profile_site {
+    const char *format;
+    uint64_t text_hash;
+    size_t offset;
+    char specifier;
+    char spec[24];
+    char format_text[64];
+    struct profile_totals totals;
+};
+
+static const char *const profile_counter_names[PROFILE_COUNTERS] = {
+    "cycles", "instructions", "branch-misses", "l1d-misses", "task-clock"
+};
+
+static int profile_group = -1;
+static int profile_slots[PROFILE_COUNTERS];
+static struct profile_totals profile_converters[UCHAR_MAX + 1];
+static struct profile_site profile_sites[PROFILE_SITES];
+static struct profile_totals profile_other_sites;
+
+static int profile_open_counter(uint32_t type, uint64_t config, int group) {
+    struct perf_event_attr attributes;
+
+    memset(&attributes, 0, sizeof(attributes));
+    attributes.size = sizeof(attributes);
+    attributes.type = type;
+    attributes.config = config;
+    attributes.read_format = PERF_FORMAT_GROUP;
+    attributes.disabled = (group == -1);
+    attributes.exclude_kernel = 1;
+    attributes.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attributes, 0, -1, group, 0);
+}
+
+static void profile_write_at_exit(void);
+
+// Open the counter group on first use; returns 0 if no counter is available
+static int profile_open(void) {
+    static const uint32_t types[PROFILE_COUNTERS] = {
+        PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE,
+        PERF_TYPE_SOFTWARE
+    };
+    static const uint64_t configs[PROFILE_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_BRANCH_MISSES,
+        PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_SW_TASK_CLOCK
+    };
+    int opened = 0;
+
+    if (profile_group != -1) {
+        return profile_group >= 0;
+    }
+
+    for (int i = 0; i < PROFILE_COUNTERS; i++) {
+        int descriptor = profile_open_counter(types[i], configs[i], profile_group);
+        profile_slots[i] = -1;
+        if (descriptor < 0) continue;
+        if (profile_group < 0) profile_group = descriptor;
+        profile_slots[i] = opened++;
+    }
+
+    if (!opened) {
+        fprintf(stderr, "myprintf: perf_event_open failed: %s\n", strerror(errno));
+        profile_group = -2;
         return 0;
     }
 
+    ioctl(profile_group, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(profile_group, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    atexit(profile_write_at_exit);
+    return 1;
+}
+
+// Current counter values in profile_counter_names order
+static void profile_read(uint64_t *values) {
+    uint64_t buffer[1 + PROFILE_COUNTERS];
+
+    memset(values, 0, PROFILE_COUNTERS * sizeof(values[0]));
+    if (read(profile_group, buffer, sizeof(buffer)) < (ssize_t)sizeof(buffer[0])) {
+        return;
+    }
+    for (int i = 0; i < PROFILE_COUNTERS; i++) {
+        if (profile_slots[i] >= 0 && (uint64_t)profile_slots[i] < buffer[0]) {
+            values[i] = buffer[1 + profile_slots[i]];
+        }
+    }
+}
+
+// FNV-1a hash of a whole format string
+static uint64_t profile_text_hash(const char *format) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *format; format++) {
+        hash = (hash ^ (unsigned char)*format) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Totals for the site of the conversion format[offset..offset + length) in
+// a format whose text hashes to text_hash
+static struct profile_totals *profile_site(const char *format, uint64_t text_hash, size_t offset,
+                                           size_t length, char specifier) {
+    size_t hash = (size_t)((uintptr_t)format >> 3) * 31 + (size_t)text_hash + offset;
+
+    for (int probe = 0; probe < PROFILE_PROBES; probe++) {
+        struct profile_site *site = &profile_sites[(hash + probe) % PROFILE_SITES];
+
+        if (site->format == format && site->text_hash == text_hash && site->offset == offset) {
+            return &site->totals;
+        }
+        if (!site->format) {
+            // Keep copies of the text: the format may be gone by exit
+            site->format = format;
+            site->text_hash = text_hash;
+            site->offset = offset;
+            site->specifier = specifier;
+            if (length >= sizeof(site->spec)) length = sizeof(site->spec) - 1;
+            memcpy(site->spec, format + offset, length);
+            strncpy(site->format_text, format, sizeof(site->format_text) - 1);
+            return &site->totals;
+        }
+    }
+    return &profile_other_sites;
+}
+
+// Add the counter deltas since start to a conversion's converter and site
+static void profile_record(const uint64_t *start, const char *format, uint64_t text_hash,
+                           const char *spec_start, const char *spec_end, char specifier) {
+    uint64_t end[PROFILE_COUNTERS];
+
+    // Stop the counters before the site lookup so its cost is not charged
+    profile_read(end);
+    struct profile_totals *converter = &profile_converters[(unsigned char)specifier];
+    struct profile_totals *site = profile_site(format, text_hash, spec_start - format,
+                                               spec_end - spec_start, specifier);
+    converter->calls++;
+    site->calls++;
+    for (int i = 0; i < PROFILE_COUNTERS; i++) {
+        converter->counters[i] += end[i] - start[i];
+        site->counters[i] += end[i] - start[i];
+    }
+}
+
+// Write text with tabs, newlines and backslashes escaped
+static void profile_write_escaped(FILE *file, const char *text) {
+    for (; *text; text++) {
+        if (*text == '\t') fputs("\\t", file);
+        else if (*text == '\n') fputs("\\n", file);
+        else if (*text == '\\') fputs("\\\\", file);
+        else fputc(*text, file);
+    }
+}
+
+static void profile_write_totals(FILE *file, const char *kind, char specifier,
+                                 const struct profile_totals *totals) {
+    fprintf(file, "%s\t%c\t%llu", kind, specifier ? specifier : '?',
+            (unsigned long long)totals->calls);
+    for (int i = 0; i < PROFILE_COUNTERS; i++) {
+        fprintf(file, "\t%llu", (unsigned long long)totals->counters[i]);
+    }
+}
+
+// Write the profile as tab-separated lines: one per converter, then one per
+// conversion site with its offset in the format, its conversion and the
+// format text
+int my_printf_profile_write(const char *path) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        return -1;
+    }
+
+    fprintf(file, "# kind\tconverter\tcalls");
+    for (int i = 0; i < PROFILE_COUNTERS; i++) {
+        fprintf(file, "\t%s", profile_counter_names[i]);
+    }
+    fprintf(file, "\toffset\tspec\tformat\n");
+
+    for (int c = 0; c <= UCHAR_MAX; c++) {
+        if (profile_converters[c].calls) {
+            profile_write_totals(file, "converter", (char)c, &profile_converters[c]);
+            fprintf(file, "\t\t\t\n");
+        }
+    }
+    for (int i = 0; i < PROFILE_SITES; i++) {
+        const struct profile_site *site = &profile_sites[i];
+        if (site->format) {
+            profile_write_totals(file, "site", site->specifier, &site->totals);
+            fprintf(file, "\t%zu\t", site->offset);
+            profile_write_escaped(file, site->spec);
+            fputc('\t', file);
+            profile_write_escaped(file, site->format_text);
+            fputc('\n', file);
+        }
+    }
+    if (profile_other_sites.calls) {
+        profile_write_totals(file, "site", 0, &profile_other_sites);
+        fprintf(file, "\t\t\t(sites beyond the table)\n");
+    }
+
+    return fclose(file) == 0 ? 0 : -1;
+}
+
+static void profile_write_at_exit(void) {
+    const char *path = getenv("MYPRINTF_PROFILE");
+    if (!path || !*path) {
+        path = "myprintf.profile";
+    }
+    if (my_printf_profile_write(path) != 0) {
+        fprintf(stderr, "myprintf: cannot write profile to %s\n", path);
+    }
+}
+#endif
+
+// Format into sink; returns the number of bytes the full output takes
+static int format_to_sink(struct sink *sink, const char *format, va_list arguments) {
+#ifdef MYPRINTF_PROFILE
+    const char *format_start = format;
+    int profiling = profile_open();
+    uint64_t format_hash = profiling ? profile_text_hash(format) : 0;
+#endif
+
     while (*format) {
         if (*format != '%') {
-            if (actual_chars_written < max_size - 1) {
-                *current_output++ = *format;
-                actual_chars_written++;
+            const char *literal = format;
+            while (*format && *format != '%') {
+                format++;
             }
-            total_chars_written++;
-            format++;
+            sink_write(sink, literal, format - literal);
             continue;
         }
 
+#ifdef MYPRINTF_PROFILE
+        const char *spec_start = format;
+        uint64_t profile_start[PROFILE_COUNTERS];
+        if (profiling) profile_read(profile_start);
+#endif
+
         format++; // Skip '%'
 
-        // Parse flags: '+' (0x01), ' ' (0x02), '-' (0x04), '0' (0x08), '#' (0x10)
-        int format_flags = 0;
+        // Parse flags: '+' (0x01), ' ' (0x02), '-' (0x04), '0' (0x08), '#' (0x10),
+        // '\'' (0x20). The quote flag makes width and precision of %s and %c count
+        // UTF-8 code points instead of bytes.
+        struct format_spec spec = {0};
         while (1) {
-            if (*format == '+') format_flags |= 0x01;
-            else if (*format == ' ') format_flags |= 0x02;
-            else if (*format == '-') format_flags |= 0x04;
-            else if (*format == '0') format_flags |= 0x08;
-            else if (*format == '#') format_flags |= 0x10;
+            if (*format == '+') spec.flags |= 0x01;
+            else if (*format == ' ') spec.flags |= 0x02;
+            else if (*format == '-') spec.flags |= 0x04;
+            else if (*format == '0') spec.flags |= 0x08;
+            else if (*format == '#') spec.flags |= 0x10;
+            else if (*format == '\'') spec.flags |= 0x20;
             else break;
             format++;
         }
 
         // Parse width
-        int width = 0;
         if (*format == '*') {
-            width = va_arg(arguments, int);
+            spec.width = va_arg(arguments, int);
             format++;
         } else {
             while (isdigit(*format)) {
-                width = width * 10 + (*format++ - '0');
+                spec.width = spec.width * 10 + (*format++ - '0');
             }
         }
 
         // Parse precision
-        int precision = -1;
+        spec.precision = -1;
         if (*format == '.') {
             format++;
-            precision = 0;
+            spec.precision = 0;
             if (*format == '*') {
-                precision = va_arg(arguments, int);
+                spec.precision = va_arg(arguments, int);
                 format++;
             } else {
                 while (isdigit(*format)) {
-                    precision = precision * 10 + (*format++ - '0');
+                    spec.precision = spec.precision * 10 + (*format++ - '0');
                 }
             }
         }
 
         // Parse length modifiers
-        enum { NONE, HH, H, L, LL, J, Z, T, LONG_DOUBLE } length_modifier = NONE;
         if (*format == 'h') {
             format++;
-            length_modifier = (*format == 'h') ? (format++, HH) : H;
+            spec.length_modifier = (*format == 'h') ? (format++, HH) : H;
         } else if (*format == 'l') {
             format++;
-            length_modifier = (*format == 'l') ? (format++, LL) : L;
+            spec.length_modifier = (*format == 'l') ? (format++, LL) : L;
         } else if (*format == 'j') {
-            length_modifier = J;
+            spec.length_modifier = J;
             format++;
         } else if (*format == 'z') {
-            length_modifier = Z;
+            spec.length_modifier = Z;
             format++;
         } else if (*format == 't') {
-            length_modifier = T;
+            spec.length_modifier = T;
             format++;
         } else if (*format == 'L') {
-            length_modifier = LONG_DOUBLE;
+            spec.length_modifier = LONG_DOUBLE;
             format++;
         }
 
-        char specifier = *format++;
-        char temp_buffer[TEMP_BUFFER_SIZE] = {0};
-        int temp_length = 0;
-
-        switch (specifier) {
+        spec.specifier = *format++;
+        int format_flags = spec.flags;
+        int precision = spec.precision;
+
+        // String and character fields are written straight from their source;
+        // every other conversion collects its argument for render_field
+        union format_argument argument = {0};
+        char character[4];
+        const char *field = NULL;
+        const wchar_t *wide_field = NULL;
+        size_t field_count = 0;
+        size_t field_length = 0;
+        int field_columns = -1;
+
+        switch (spec.specifier) {
             case 'd':
             case 'i': {
-                intmax_t value;
-                switch (length_modifier) {
-                    case HH: value = (char)va_arg(arguments, int); break;
-                    case H: value = (short)va_arg(arguments, int); break;
-                    case L: value = va_arg(arguments, long); break;
-                    case LL: value = va_arg(arguments, long long); break;
-                    case J: value = va_arg(arguments, intmax_t); break;
-                    case Z: value = va_arg(arguments, size_t); break;
-                    case T: value = va_arg(arguments, ptrdiff_t); break;
-                    default: value = va_arg(arguments, int); break;
+                switch (spec.length_modifier) {
+                    case HH: argument.signed_value = (char)va_arg(arguments, int); break;
+                    case H: argument.signed_value = (short)va_arg(arguments, int); break;
+                    case L: argument.signed_value = va_arg(arguments, long); break;
+                    case LL: argument.signed_value = va_arg(arguments, long long); break;
+                    case J: argument.signed_value = va_arg(arguments, intmax_t); break;
+                    case Z: argument.signed_value = va_arg(arguments, size_t); break;
+                    case T: argument.signed_value = va_arg(arguments, ptrdiff_t); break;
+                    default: argument.signed_value = va_arg(arguments, int); break;
                 }
-                int is_negative = value < 0;
-                uintmax_t abs_value = is_negative ? -value : value;
-
-                if (!is_negative) {
-                    if (format_flags & 0x01) temp_buffer[temp_length++] = '+';
-                    else if (format_flags & 0x02) temp_buffer[temp_length++] = ' ';
-                }
-                temp_length += integer_to_string(abs_value, temp_buffer + temp_length, 
-                                               10, 0, 1, is_negative, precision);
                 break;
             }
             case 'u':
             case 'x':
             case 'X':
             case 'o': {
-                uintmax_t value;
-                int base = (specifier == 'u') ? 10 : (specifier == 'o') ? 8 : 16;
-                int use_uppercase = (specifier == 'X');
-
-                switch (length_modifier) {
-                    case HH: value = (unsigned char)va_arg(arguments, unsigned int); break;
-                    case H: value = (unsigned short)va_arg(arguments, unsigned int); break;
-                    case L: value = va_arg(arguments, unsigned long); break;
-                    case LL: value = va_arg(arguments, unsigned long long); break;
-                    case J: value = va_arg(arguments, uintmax_t); break;
-                    case Z: value = va_arg(arguments, size_t); break;
-                    case T: value = va_arg(arguments, ptrdiff_t); break;
-                    default: value = va_arg(arguments, unsigned int); break;
-                }
-
-                if ((format_flags & 0x10) && value != 0) {
-                    if (specifier == 'o') {
-                        temp_buffer[temp_length++] = '0';
-                    } else if (specifier == 'x' || specifier == 'X') {
-                        temp_buffer[temp_length++] = '0';
-                        temp_buffer[temp_length++] = use_uppercase ? 'X' : 'x';
-                    }                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                        
+                switch (spec.length_modifier) {
+                    case HH: argument.unsigned_value = (unsigned char)va_arg(arguments, unsigned int); break;
+                    case H: argument.unsigned_value = (unsigned short)va_arg(arguments, unsigned int); break;
+                    case L: argument.unsigned_value = va_arg(arguments, unsigned long); break;
+                    case LL: argument.unsigned_value = va_arg(arguments, unsigned long long); break;
+                    case J: argument.unsigned_value = va_arg(arguments, uintmax_t); break;
+                    case Z: argument.unsigned_value = va_arg(arguments, size_t); break;
+                    case T: argument.unsigned_value = va_arg(arguments, ptrdiff_t); break;
+                    default: argument.unsigned_value = va_arg(arguments, unsigned int); break;
                 }
-                temp_length += integer_to_string(value, temp_buffer + temp_length, 
-                                               base, use_uppercase, 0, 0, precision);
                 break;
             }
             case 'c': {
-                temp_buffer[temp_length++] = (char)va_arg(arguments, int);
+                if (spec.length_modifier == L) {
+                    field_length = utf8_encode((uint32_t)va_arg(arguments, wint_t), character);
+                    field_columns = 1;
+                } else {
+                    character[field_length++] = (char)va_arg(arguments, int);
+                }
+                field = character;
+                field_count = field_length;
                 break;
             }
             case 's': {
+                int count_code_points = format_flags & 0x20;
+
+                if (spec.length_modifier == L) {
+                    wide_field = va_arg(arguments, const wchar_t *);
+                    if (!wide_field) wide_field = L"(null)";
+
+                    size_t limit = (precision >= 0) ? (size_t)precision : SIZE_MAX;
+                    field_length = wide_utf8_length(wide_field, count_code_points ? limit : SIZE_MAX,
+                                                    count_code_points ? SIZE_MAX : limit, &field_count);
+                    field_columns = field_count;
+                    break;
+                }
+
                 const char *string = va_arg(arguments, const char *);
                 if (!string) string = "(null)";
 
-                int string_length = strlen(string);
-                if (precision >= 0 && precision < string_length) {
-                    string_length = precision;
+                // With a precision, never read past the bytes it can cover
+                size_t string_length;
+                size_t points;
+                if (precision >= 0 && count_code_points) {
+                    string_length = utf8_span_terminated(string, precision, &points);
+                    field_columns = points;
+                } else if (precision >= 0) {
+                    const char *end = memchr(string, '\0', precision);
+                    string_length = end ? (size_t)(end - string) : (size_t)precision;
+                } else {
+                    string_length = strlen(string);
+                    if (count_code_points) {
+                        string_length = utf8_span(string, string_length, SIZE_MAX, &points);
+                        field_columns = points;
+                    }
                 }
-                strncpy(temp_buffer, string, string_length);
-                temp_length = string_length;
+                field = string;
+                field_length = field_count = string_length;
                 break;
             }
             case 'p': {
-                temp_length = pointer_to_string(va_arg(arguments, void *), temp_buffer);
+                argument.pointer = va_arg(arguments, void *);
                 break;
             }
             case 'n': {
                 int *count_ptr = va_arg(arguments, int *);
-                *count_ptr = total_chars_written;
+                *count_ptr = sink->total;
                 break;
             }
             case 'f':
-            case 'F': {
-                double value = (length_modifier == LONG_DOUBLE) ? 
-                              va_arg(arguments, long double) : va_arg(arguments, double);
-                temp_length = float_to_string(value, temp_buffer, precision, format_flags, 
-                                             (specifier == 'F'));
-                break;
-            }
+            case 'F':
             case 'e':
-            case 'E': {
-                double value = (length_modifier == LONG_DOUBLE) ? 
-                              va_arg(arguments, long double) : va_arg(arguments, double);
-                temp_length = scientific_to_string(value, temp_buffer, precision, 
-                                                 (specifier == 'E'), format_flags);
-                break;
-            }
+            case 'E':
             case 'g':
-            case 'G': {
-                double value = (length_modifier == LONG_DOUBLE) ? 
-                              va_arg(arguments, long double) : va_arg(arguments, double);
-                temp_length = shortest_float_to_string(value, temp_buffer, precision, 
-                                                     (specifier == 'G'), format_flags);
-                break;
-            }
+            case 'G':
             case 'a':
             case 'A': {
-                double value = (length_modifier == LONG_DOUBLE) ? 
-                              va_arg(arguments, long double) : va_arg(arguments, double);
-                temp_length = hex_float_to_string(value, temp_buffer, precision, 
-                                                (specifier == 'A'), format_flags);
+                argument.float_value = (spec.length_modifier == LONG_DOUBLE) ?
+                                       va_arg(arguments, long double) : va_arg(arguments, double);
                 break;
             }
-            case '%': {
-                temp_buffer[temp_length++] = '%';
-                break;
-            }
-            default: {
-                temp_buffer[temp_length++] = '%';
-                temp_buffer[temp_length++] = specifier;
+        }
+
+#ifndef MYPRINTF_LEAN_STACK
+        // Stage the field so its length is known before padding
+        char temp_buffer[TEMP_BUFFER_SIZE];
+        if (!field && !wide_field) {
+            struct sink staging = sink_for_buffer(temp_buffer, TEMP_BUFFER_SIZE);
+            render_field(&staging, &spec, argument);
+            if (staging.total <= TEMP_BUFFER_SIZE) {
+                field = temp_buffer;
+                field_length = field_count = staging.total;
             }
         }
+#endif
 
         // Handle padding
-        int padding_length = (width > temp_length) ? width - temp_length : 0;
+        int left_justify = format_flags & 0x04;
+        char padding_char = (format_flags & 0x08 && !(spec.specifier == 's' || spec.specifier == 'c')) ?
+                            '0' : ' ';
 
-        if (format_flags & 0x04) { // Left justify
-            for (int i = 0; i < temp_length && actual_chars_written < max_size - 1; i++) {
-                *current_output++ = temp_buffer[i];
-                actual_chars_written++;
+        if (field || wide_field) {
+            if (field_columns < 0 || !(format_flags & 0x20)) {
+                field_columns = field_length;
             }
-            total_chars_written += temp_length;
+            int padding_length = (spec.width > field_columns) ? spec.width - field_columns : 0;
 
-            for (int i = 0; i < padding_length; i++) {
-                if (actual_chars_written < max_size - 1) {
-                    *current_output++ = ' ';
-                    actual_chars_written++;
-                }
-                total_chars_written++;
-            }
-        } else { // Right justify
-            char padding_char = (format_flags & 0x08 && !(specifier == 's' || specifier == 'c')) ? 
-                               '0' : ' ';
-            for (int i = 0; i < padding_length; i++) {
-                if (actual_chars_written < max_size - 1) {
-                    *current_output++ = padding_char;
-                    actual_chars_written++;
+            if (!left_justify) sink_fill(sink, padding_char, padding_length);
+            write_field(sink, field, wide_field, field_count);
+            if (left_justify) sink_fill(sink, ' ', padding_length);
+        } else {
+            // Stream the field; padding in front of it is sized by a counting pass
+            size_t start = sink->total;
+            if (!left_justify && spec.width > 0) {
+                struct sink counter = sink_for_buffer(NULL, 0);
+                render_field(&counter, &spec, argument);
+                if ((size_t)spec.width > counter.total) {
+                    sink_fill(sink, padding_char, spec.width - (int)counter.total);
                 }
-                total_chars_written++;
+                start = sink->total;
             }
-            for (int i = 0; i < temp_length && actual_chars_written < max_size - 1; i++) {
-                *current_output++ = temp_buffer[i];
-                actual_chars_written++;
+            render_field(sink, &spec, argument);
+            size_t length = sink->total - start;
+            if (left_justify && (size_t)spec.width > length) {
+                sink_fill(sink, ' ', spec.width - (int)length);
             }
-            total_chars_written += temp_length;
         }
+
+#ifdef MYPRINTF_PROFILE
+        if (profiling) {
+            profile_record(profile_start, format_start, format_hash, spec_start, format,
+                           spec.specifier);
+        }
+#endif
     }
 
-    if (actual_chars_written < max_size) {
-        *current_output = '\0';
-    } else {
-        output[max_size - 1] = '\0';
+    return sink->total;
+}
+
+// Main formatting function
+int my_vsnprintf(char *output, size_t max_size, const char *format, va_list arguments) {
+    if (max_size == 0) return 0;
+    if (max_size == 1) {
+        *output = '\0';
+        return 0;
     }
 
-    return total_chars_written;
+    struct sink sink = sink_for_buffer(output, max_size - 1);
+    int count = format_to_sink(&sink, format, arguments);
+    output[sink.position] = '\0';
+    return count;
 }
 
 // Wrapper for snprintf
@@ -640,6 +1278,22 @@ int my_snprintf(char *output, size_t max_size, const char *format, ...) {
 
 // Wrapper for printf
 int my_printf(const char *format, ...) {
+#ifdef MYPRINTF_LEAN_STACK
+    char chunk[SINK_CHUNK_SIZE];
+    struct sink sink = sink_for_buffer(chunk, sizeof(chunk));
+    sink.stream = stdout;
+
+    va_list arguments;
+    va_start(arguments, format);
+    int count = format_to_sink(&sink, format, arguments);
+    va_end(arguments);
+
+    sink_flush(&sink);
+    if (sink.failed) {
+        errno = EIO;
+        return -1;
+    }
+#else
     char output[MAX_OUTPUT_SIZE];
     va_list arguments;
     va_start(arguments, format);
@@ -650,10 +1304,12 @@ int my_printf(const char *format, ...) {
         errno = EIO;
         return -1;
     }
+#endif
 
     return count;
 }
 
+#ifndef MYPRINTF_NO_MAIN
 // Main function with test cases
 int main() {
     // Basic formatting
@@ -667,6 +1323,14 @@ int main() {
     my_printf("String: %s\n", "Hello, World!");
     my_printf("Null string: %s\n", (char *)NULL);
 
+    // Wide characters and UTF-8 columns
+    my_printf("Wide char: %lc\n", (wint_t)0x00E9);
+    my_printf("Wide string: %ls\n", L"na\u00EFve caf\u00E9");
+    my_printf("Wide string precision: %.4ls|\n", L"\u00E9t\u00E9");
+    my_printf("Byte columns: [%-8s]\n", "Jos\u00E9");
+    my_printf("Code point columns: [%'-8s]\n", "Jos\u00E9");
+    my_printf("Code point precision: [%'.3s]\n", "\u00FCber");
+
     // Floating point
     my_printf("Float default: %f\n", 3.14159);
     my_printf("Float with precision: %.2f\n", 3.14159);
@@ -743,4 +1407,5 @@ int main() {
     my_printf("Combined flags: %+0#10.5x\n", 255);
 
     return 0;
-}
\ No newline at end of file
+}
+#endif
@@ -0,0 +1,198 @@
+// Rank converters and conversion sites from profiles written by a
+// -DMYPRINTF_PROFILE build. Profiles from several runs are merged.
+//
+//   profile_report [-s cycles|instructions|branch-misses|l1d-misses|task-clock|calls]
+//                  [-n top] profile...
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PROFILE_COUNTERS 5
+#define MAX_ROWS 8192
+#define FIELD_SIZE 128
+
+// A converter or site with its summed counters
+struct row {
+    int is_site;
+    char converter;
+    long offset;
+    char spec[FIELD_SIZE];
+    char format[FIELD_SIZE];
+    unsigned long long calls;
+    unsigned long long counters[PROFILE_COUNTERS];
+};
+
+static const char *const counter_names[PROFILE_COUNTERS] = {
+    "cycles", "instructions", "branch-misses", "l1d-misses", "task-clock"
+};
+
+static struct row rows[MAX_ROWS];
+static int row_count;
+static int sort_counter; // index into counters, or -1 for calls
+
+static unsigned long long sort_key(const struct row *row) {
+    return (sort_counter < 0) ? row->calls : row->counters[sort_counter];
+}
+
+static int compare_rows(const void *a, const void *b) {
+    unsigned long long left = sort_key(a);
+    unsigned long long right = sort_key(b);
+    return (left < right) - (left > right);
+}
+
+// Split line at tabs in place; returns the number of fields
+static int split_fields(char *line, char **fields, int max_fields) {
+    int count = 0;
+    line[strcspn(line, "\n")] = '\0';
+    while (count < max_fields) {
+        fields[count++] = line;
+        line = strchr(line, '\t');
+        if (!line) break;
+        *line++ = '\0';
+    }
+    return count;
+}
+
+// Sites are keyed by their offset too, so repeated specs in one format
+// stay apart
+static struct row *find_row(int is_site, char converter, long offset, const char *spec,
+                            const char *format) {
+    for (int i = 0; i < row_count; i++) {
+        if (rows[i].is_site == is_site && rows[i].converter == converter &&
+            rows[i].offset == offset && strcmp(rows[i].spec, spec) == 0 && strcmp(rows[i].format, format) == 0) {
+            return &rows[i];
+        }
+    }
+    if (row_count == MAX_ROWS) {
+        return NULL;
+    }
+
+    struct row *row = &rows[row_count++];
+    row->is_site = is_site;
+    row->converter = converter;
+    row->offset = offset;
+    snprintf(row->spec, sizeof(row->spec), "%s", spec);
+    snprintf(row->format, sizeof(row->format), "%s", format);
+    return row;
+}
+
+static int load_profile(const char *path) {
+    char line[1024];
+    char *fields[6 + PROFILE_COUNTERS];
+    FILE *file = fopen(path, "r");
+
+    if (!file) {
+        perror(path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), file)) {
+        if (line[0] == '#') continue;
+
+        int count = split_fields(line, fields, 6 + PROFILE_COUNTERS);
+        if (count < 3 + PROFILE_COUNTERS) continue;
+
+        int is_site = strcmp(fields[0], "site") == 0;
+        long offset = (count > 3 + PROFILE_COUNTERS && fields[3 + PROFILE_COUNTERS][0]) ?
+                      strtol(fields[3 + PROFILE_COUNTERS], NULL, 10) : -1;
+        const char *spec = (count > 4 + PROFILE_COUNTERS) ? fields[4 + PROFILE_COUNTERS] : "";
+        const char *format = (count > 5 + PROFILE_COUNTERS) ? fields[5 + PROFILE_COUNTERS] : "";
+        struct row *row = find_row(is_site, fields[1][0], offset, spec, format);
+        if (!row) {
+            fprintf(stderr, "%s: more than %d rows, ignoring the rest\n", path, MAX_ROWS);
+            break;
+        }
+
+        row->calls += strtoull(fields[2], NULL, 10);
+        for (int i = 0; i < PROFILE_COUNTERS; i++) {
+            row->counters[i] += strtoull(fields[3 + i], NULL, 10);
+        }
+    }
+    fclose(file);
+    return 0;
+}
+
+static double per_call(const struct row *row, int counter) {
+    return row->calls ? (double)row->counters[counter] / row->calls : 0.0;
+}
+
+static void print_rows(int sites, int top) {
+    const char *metric = (sort_counter < 0) ? "calls" : counter_names[sort_counter];
+    int printed = 0;
+
+    printf("%s by %s\n", sites ? "Conversion sites" : "Converters", metric);
+    printf("%-4s %10s %12s %10s %6s %10s %10s %10s", "conv", "calls", metric, "cyc/call",
+           "IPC", "brmiss/c", "l1dmiss/c", "ns/call");
+    printf(sites ? "  %6s %-12s %s\n" : "\n", "offset", "spec", "format");
+
+    for (int i = 0; i < row_count && printed < top; i++) {
+        const struct row *row = &rows[i];
+        if (row->is_site != sites) continue;
+
+        double cycles = per_call(row, 0);
+        double ipc = row->counters[0] ? (double)row->counters[1] / row->counters[0] : 0.0;
+        printf("%%%-3c %10llu %12llu %10.1f %6.2f %10.2f %10.2f %10.1f", row->converter,
+               row->calls, sort_key(row), cycles, ipc, per_call(row, 2), per_call(row, 3),
+               per_call(row, 4));
+        if (sites) {
+            if (row->offset >= 0) {
+                printf("  %6ld %-12s %s", row->offset, row->spec, row->format);
+            } else {
+                printf("  %6s %-12s %s", "", row->spec, row->format);
+            }
+        }
+        putchar('\n');
+        printed++;
+    }
+    putchar('\n');
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "usage: %s [-s cycles|instructions|branch-misses|l1d-misses|task-clock|calls]"
+                    " [-n top] profile...\n", program);
+}
+
+int main(int argc, char **argv) {
+    int top = 20;
+    int argi = 1;
+
+    for (; argi + 1 < argc && argv[argi][0] == '-'; argi += 2) {
+        if (strcmp(argv[argi], "-n") == 0) {
+            top = atoi(argv[argi + 1]);
+        } else if (strcmp(argv[argi], "-s") == 0) {
+            sort_counter = -2;
+            if (strcmp(argv[argi + 1], "calls") == 0) sort_counter = -1;
+            for (int i = 0; i < PROFILE_COUNTERS; i++) {
+                if (strcmp(argv[argi + 1], counter_names[i]) == 0) sort_counter = i;
+            }
+            if (sort_counter == -2) {
+                usage(argv[0]);
+                return 2;
+            }
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (argi >= argc) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    for (; argi < argc; argi++) {
+        if (load_profile(argv[argi]) != 0) return 1;
+    }
+
+    // Without cycle counts (some VMs and containers) fall back to task-clock
+    if (sort_counter == 0) {
+        int have_cycles = 0;
+        for (int i = 0; i < row_count; i++) {
+            have_cycles |= rows[i].counters[0] != 0;
+        }
+        if (!have_cycles) sort_counter = 4;
+    }
+
+    qsort(rows, row_count, sizeof(rows[0]), compare_rows);
+    print_rows(0, top);
+    print_rows(1, top);
+    return 0;
+}